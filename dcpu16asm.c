@@ -25,29 +25,161 @@
    Karl Hobley <turbodog10@yahoo.co.uk>
 */
 
+/*
+ * Build with "cc -pthread". Use -j to split the input into chunks that are
+ * assembled on separate threads, the output is the same as with one thread.
+ */
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Longest line, including the newline. Long DAT tables are the main reason for this being large */
+#define MAX_LINE_LENGTH 4096
 
-int line_num;
-int exit_app;
-FILE* output;
-int current_address;
+/* Most threads -j will start */
+#define MAX_THREADS 256
+
+/* Only print the listing when assembling on one thread, so it comes out in order */
+int listing;
 
 struct label
 {
-	char name[255];
+	unsigned int name; /* Offset into the chunk's name pool */
 	unsigned int address;
-} labels[256];
-
-int label_count;
+};
 
 struct labelref
 {
-	char name[255];
+	unsigned int name; /* Offset into the chunk's name pool */
+	unsigned int address;
+	int data; /* From DAT, these must be defined */
+};
+
+/*
+ * A run of whole lines from the input and everything assembled from it. Addresses are relative to the start of
+ * the chunk until base_address is known.
+ */
+struct chunk
+{
+	const char* text;
+	const char* text_start;
+	const char* text_end;
+	int first_line;
+	int line_num; /* Relative to the start of the chunk */
+	int exit_app;
+	char error[300];
+	
+	int current_address;
+	unsigned int base_address;
+	unsigned short* words;
+	int word_capacity;
+	
+	char* names;
+	int names_size;
+	int names_capacity;
+	
+	struct label* labels;
+	int label_count;
+	int label_capacity;
+	
+	struct labelref* labelrefs;
+	int labelref_count;
+	int labelref_capacity;
+	
+	pthread_t thread;
+	int threaded;
+};
+
+/*
+ * Labels from every chunk, hashed by name. Later labels replace earlier ones with the same name
+ */
+struct linked_label
+{
+	const char* name;
 	unsigned int address;
-} labelrefs[256];
+} *label_table;
+
+unsigned int label_table_size;
+
+/*
+ * This makes room for count items in a growable array
+ */
+void* grow_array(void* array, int* capacity, int count, size_t item_size)
+{
+	if (count <= *capacity)
+		return array;
+	while (*capacity < count)
+		*capacity = *capacity == 0 ? 256 : *capacity * 2;
+	array = realloc(array, *capacity * item_size);
+	if (array == 0) {
+		printf("out of memory\n");
+		exit(1);
+	}
+	return array;
+}
+
+void set_error(struct chunk* chunk, const char* message)
+{
+	strncpy(chunk->error, message, sizeof(chunk->error) - 1);
+	chunk->exit_app = 1;
+}
+
+/*
+ * Returns 0 if count words at address would run past the end of the 64K word address space
+ */
+int check_address_space(struct chunk* chunk, int count, int address)
+{
+	if (chunk->base_address + address + count > 0x10000) {
+		set_error(chunk, "Program is bigger than 64K words");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * This adds words to the end of the chunk's output
+ */
+void append_words(struct chunk* chunk, const unsigned short* words, int count, int address)
+{
+	if (check_address_space(chunk, count, address) == 0)
+		return;
+	chunk->words = grow_array(chunk->words, &chunk->word_capacity, address + count, sizeof(unsigned short));
+	memcpy(&chunk->words[address], words, count * sizeof(unsigned short));
+}
+
+unsigned int add_name(struct chunk* chunk, const char* name, int length)
+{
+	unsigned int offset = chunk->names_size;
+	chunk->names = grow_array(chunk->names, &chunk->names_capacity, chunk->names_size + length + 1, 1);
+	memcpy(&chunk->names[offset], name, length);
+	chunk->names[offset + length] = 0;
+	chunk->names_size += length + 1;
+	return offset;
+}
+
+void add_label(struct chunk* chunk, const char* name, int length)
+{
+	chunk->labels = grow_array(chunk->labels, &chunk->label_capacity, chunk->label_count + 1, sizeof(struct label));
+	chunk->labels[chunk->label_count].name = add_name(chunk, name, length);
+	chunk->labels[chunk->label_count].address = chunk->current_address;
+	chunk->label_count++;
+}
 
-int labelref_count;
+void add_labelref(struct chunk* chunk, const char* name, unsigned int address, int data)
+{
+	chunk->labelrefs = grow_array(chunk->labelrefs, &chunk->labelref_capacity, chunk->labelref_count + 1, sizeof(struct labelref));
+	chunk->labelrefs[chunk->labelref_count].name = add_name(chunk, name, strnlen(name, 254));
+	chunk->labelrefs[chunk->labelref_count].address = address;
+	chunk->labelrefs[chunk->labelref_count].data = data;
+	chunk->labelref_count++;
+}
 
 unsigned char get_register_id(char reg)
 {
@@ -70,34 +202,59 @@ unsigned char get_register_id(char reg)
 	}
 }
 
+int is_word_char(char c)
+{
+	return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
 /*
- * This removes whitespace and comments. It also converts all text to uppercase.
+ * This removes whitespace and comments. It also converts all text to uppercase. Strings are left as they are.
+ * Whitespace between two words is kept as a single space, so "DAT 1 2" doesn't turn into "DAT12".
  */
-void clean_line(char* cleaned_line, const char* line)
+void clean_line(struct chunk* chunk, char* cleaned_line, const char* line)
 {
 	/* Loop through chars */
 	int char_num = 0;
 	int clean_char_num = 0;
-	while (line[char_num] != 0 && line[char_num] != '\n' && line[char_num] != ';') {
+	int in_string = 0;
+	int separated = 0;
+	while (line[char_num] != 0 && line[char_num] != '\n' && (line[char_num] != ';' || in_string)) {
+		/* Copy strings without changing them */
+		if (line[char_num] == '"' || in_string) {
+			if (line[char_num] == '"')
+				in_string = !in_string;
+			cleaned_line[clean_char_num] = line[char_num];
+			clean_char_num++;
+			char_num++;
+			continue;
+		}
+		
 		/* Look for labels */
 		if(line[char_num] == ':') {
+			char label_name[255];
 			int label_char_num = 0;
 			char_num++;
 			while ((line[char_num] >= '0' && line[char_num] <= '9')
 				|| (line[char_num] >= 'a' && line[char_num] <= 'z')
 				|| (line[char_num] >= 'A' && line[char_num] <= 'Z')) {
 					
-				if (line[char_num] >= 'a' && line[char_num] <= 'z')
-					labels[label_count].name[label_char_num] = toupper(line[char_num]);
-				else
-					labels[label_count].name[label_char_num] = line[char_num];
-				labels[label_count].address = current_address;
+				if (label_char_num < 254) {
+					if (line[char_num] >= 'a' && line[char_num] <= 'z')
+						label_name[label_char_num] = toupper(line[char_num]);
+					else
+						label_name[label_char_num] = line[char_num];
+					label_char_num++;
+				}
 				char_num++;
-				label_char_num++;
 			}
-			label_count++;
+			add_label(chunk, label_name, label_char_num);
 		}
 		
+		/* Remember whitespace after a word */
+		if ((line[char_num] == ' ' || line[char_num] == '\t')
+			&& clean_char_num > 0 && is_word_char(cleaned_line[clean_char_num - 1]))
+			separated = 1;
+			
 		/* Filter out non characters */
 		if (line[char_num] >= '!' && line[char_num] <= '~')
 		{
@@ -107,6 +264,13 @@ void clean_line(char* cleaned_line, const char* line)
 			if (current_char >= 'a' && current_char <= 'z')
 				current_char = toupper(current_char);
 				
+			/* Keep a space between words */
+			if (separated && is_word_char(current_char)) {
+				cleaned_line[clean_char_num] = ' ';
+				clean_char_num++;
+			}
+			separated = 0;
+				
 			/* Place in cleaned line */
 			cleaned_line[clean_char_num] = current_char;
 			clean_char_num++;
@@ -120,10 +284,43 @@ void clean_line(char* cleaned_line, const char* line)
 	cleaned_line[clean_char_num] = 0;
 }
 
+/*
+ * This converts a decimal or hex literal into a value. Returns 0 if it isn't a valid literal
+ */
+int parse_literal(const char* text, unsigned short* value)
+{
+	int base = 10;
+	*value = 0;
+	
+	/* Check for hex */
+	if (text[0] == '0' && text[1] == 'X') {
+		base = 16;
+		text += 2;
+	}
+	if (text[0] == 0)
+		return 0;
+		
+	while (*text != 0) {
+		/* Get Digit value */
+		int digit_val = -1;
+		if (*text >= '0' && *text <= '9')
+			digit_val = *text - '0';
+		if (*text >= 'A' && *text <= 'F' && base == 16)
+			digit_val = *text - 'A' + 10;
+		if (digit_val == -1)
+			return 0;
+			
+		/* Merge into final number */
+		*value = (*value * base) + digit_val;
+		text++;
+	}
+	return 1;
+}
+
 /*
  * This takes a parameter string. eg, "A", "0x1234", "[0x1234]" and converts it into a 6 bit value
  */
-unsigned char decode_parameter(char* param, int* extra_word_needed, unsigned short* extra_word_value)
+unsigned char decode_parameter(struct chunk* chunk, char* param, int* extra_word_needed, unsigned short* extra_word_value)
 {
 	/* Check for square brackets */
 	int square_brackets = 0;
@@ -141,14 +338,12 @@ unsigned char decode_parameter(char* param, int* extra_word_needed, unsigned sho
 	if (first_sqbracket == 1) {
 		square_brackets = 1;
 		if (last_sqbracket != 1) {
-			printf("Missing last square bracket on line %d\n", line_num);
-			exit_app = 1;
+			set_error(chunk, "Missing last square bracket");
 			return 0;
 		}
 	} else {
 		if (last_sqbracket == 1) {
-			printf("Missing first square bracket on line %d\n", line_num);
-			exit_app = 1;
+			set_error(chunk, "Missing first square bracket");
 			return 0;
 		}
 	}
@@ -176,8 +371,7 @@ unsigned char decode_parameter(char* param, int* extra_word_needed, unsigned sho
 			} else {
 				/* Check for errors */
 				if (digit_val == -1) {
-					printf("invalid literal on line %d\n", line_num);
-					exit_app = 1;
+					set_error(chunk, "invalid literal");
 					return 0;
 				}
 				
@@ -224,8 +418,7 @@ unsigned char decode_parameter(char* param, int* extra_word_needed, unsigned sho
 			} else {
 				/* Check for errors */
 				if (digit_val == -1) {
-					printf("invalid literal on line %d\n", line_num);
-					exit_app = 1;
+					set_error(chunk, "invalid literal");
 					return 0;
 				}
 				
@@ -274,24 +467,184 @@ unsigned char decode_parameter(char* param, int* extra_word_needed, unsigned sho
 	}
 	
 	/* Must be a label, store a labelref */
-	strncpy(labelrefs[labelref_count].name, param, 255);
-	labelrefs[labelref_count].address = current_address;
-	labelref_count++;
+	add_labelref(chunk, param, chunk->current_address, 0);
 	*extra_word_needed = 1; /* Allocate blank extra word, this will be where the pointer to the label will be stored at link stage */
 	*extra_word_value = 0; 
 	return 0x1f;
 }
 
-void process_line(char* uncleaned_line)
+/*
+ * This writes the words of a DAT line. Items can be numbers, strings or labels
+ */
+void process_dat(struct chunk* chunk, char* data)
+{
+	unsigned short words[MAX_LINE_LENGTH];
+	int word_count = 0;
+	
+	if (*data == 0) {
+		set_error(chunk, "Missing data");
+		return;
+	}
+	
+	while (*data != 0) {
+		if (*data == '"') {
+			/* String, one word per character */
+			data++;
+			while (*data != '"' && *data != 0) {
+				words[word_count] = *data;
+				word_count++;
+				data++;
+			}
+			if (*data != '"') {
+				set_error(chunk, "Missing closing quote");
+				return;
+			}
+			data++;
+		} else {
+			/* Find end of item */
+			char* end = data;
+			while (*end != ',' && *end != 0)
+				end++;
+			char end_char = *end;
+			*end = 0;
+			
+			if (data[0] == 0) {
+				set_error(chunk, "Missing data");
+				return;
+			}
+			
+			/* Anything that isn't a number must be a label name */
+			int char_num = 0;
+			while (is_word_char(data[char_num]))
+				char_num++;
+			if (data[char_num] != 0 || (data[0] >= '0' && data[0] <= '9')) {
+				if (parse_literal(data, &words[word_count]) == 0) {
+					set_error(chunk, "invalid literal");
+					return;
+				}
+			} else {
+				/* Store a labelref */
+				add_labelref(chunk, data, chunk->current_address + word_count, 1);
+				words[word_count] = 0;
+			}
+			word_count++;
+			
+			*end = end_char;
+			data = end;
+		}
+		
+		/* Move onto next item */
+		if (*data == ',') {
+			data++;
+			if (*data == 0) {
+				set_error(chunk, "Missing data");
+				return;
+			}
+		} else if (*data != 0) {
+			set_error(chunk, "Missing comma");
+			return;
+		}
+	}
+	
+	/* Print to screen */
+	if (listing) {
+		int word_num = 0;
+		for (word_num = 0; word_num < word_count; word_num++)
+			printf("%04X ", words[word_num]);
+		printf("\n");
+	}
+	
+	/* Write to chunk */
+	append_words(chunk, words, word_count, chunk->current_address);
+	chunk->current_address += word_count;
+}
+
+/*
+ * This copies a binary file straight into the output. The file must already be in the output's byte order
+ */
+void process_incbin(struct chunk* chunk, char* filename)
+{
+	/* Remove quotes */
+	int length = strlen(filename);
+	if (length < 2 || filename[0] != '"' || filename[length - 1] != '"') {
+		set_error(chunk, "Missing quotes around file name");
+		return;
+	}
+	filename[length - 1] = 0;
+	filename++;
+	
+	/* Open file */
+	int file = open(filename, O_RDONLY);
+	if (file == -1) {
+		snprintf(chunk->error, sizeof(chunk->error), "failed to open %s", filename);
+		chunk->exit_app = 1;
+		return;
+	}
+	struct stat file_stat;
+	if (fstat(file, &file_stat) == -1) {
+		snprintf(chunk->error, sizeof(chunk->error), "failed to read %s", filename);
+		close(file);
+		chunk->exit_app = 1;
+		return;
+	}
+	size_t size = file_stat.st_size;
+	
+	/* Map it and copy it into the chunk in one go */
+	int word_count = (size + 1) / 2;
+	if (check_address_space(chunk, word_count, chunk->current_address) == 0) {
+		close(file);
+		return;
+	}
+	chunk->words = grow_array(chunk->words, &chunk->word_capacity, chunk->current_address + word_count, sizeof(unsigned short));
+	if (size > 0) {
+		chunk->words[chunk->current_address + word_count - 1] = 0; /* Padding for odd sizes */
+		void* data = mmap(0, size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (data == MAP_FAILED) {
+			snprintf(chunk->error, sizeof(chunk->error), "failed to read %s", filename);
+			close(file);
+			chunk->exit_app = 1;
+			return;
+		}
+		memcpy(&chunk->words[chunk->current_address], data, size);
+		munmap(data, size);
+	}
+	close(file);
+	
+	if (listing)
+		printf("INCBIN: %s (%d words)\n", filename, word_count);
+	chunk->current_address += word_count;
+}
+
+/*
+ * Skips the space clean_line() leaves between an instruction and its parameters
+ */
+char* skip_space(char* text)
+{
+	if (*text == ' ')
+		text++;
+	return text;
+}
+
+void process_line(struct chunk* chunk, char* uncleaned_line)
 {
 	/* Clean line */
-	char line[256];
-	clean_line(line, uncleaned_line);
+	char line[MAX_LINE_LENGTH];
+	clean_line(chunk, line, uncleaned_line);
 	
 	/* Check if this is a blank line */
 	if (strlen(line) == 0)
 		return;
 		
+	/* Data */
+	if (strncmp("DAT", line, 3) == 0) {
+		process_dat(chunk, skip_space(line + 3));
+		return;
+	}
+	if (strncmp(".INCBIN", line, 7) == 0) {
+		process_incbin(chunk, skip_space(line + 7));
+		return;
+	}
+	
 	/* Work out instruction */
 	int basic_opcode = 0;
 	int non_basic_opcode = 0;
@@ -334,22 +687,21 @@ void process_line(char* uncleaned_line)
 		if (strncmp("JSR", line, 3) == 0) {
 			non_basic_opcode = 0x1;
 		} else {
-			printf("Unrecognised instruction on line %d\n", line_num);
-			exit_app = 1;
+			set_error(chunk, "Unrecognised instruction");
 			return;
 		}
 	}
 	
 	/* Decode basic instructions */
 	if (basic_opcode != 0) {
-		char* parameters = line + 3; /* Cut off first 3 characters */
+		char* parameters = skip_space(line + 3); /* Cut off first 3 characters */
 		unsigned char parametera = 0, parameterb = 0;
 		
 		/* Find comma */
 		int char_num = 0;
 		while (parameters[char_num] != ','
 			&& parameters[char_num] != '\n'
-			&& parameters[char_num] != 0 && char_num < 256)
+			&& parameters[char_num] != 0 && char_num < MAX_LINE_LENGTH)
 			char_num++;
 			
 		if (parameters[char_num] == ',') {
@@ -359,138 +711,370 @@ void process_line(char* uncleaned_line)
 			char* paramb = parameters + char_num + 1;
 			
 			/* Increment address for the start word */
-			current_address++;
+			chunk->current_address++;
 			
 			/* Parameter A */
 			int parametera_extra_word_needed = 0;
 			unsigned short parametera_extra_word_value = 0;
-			parametera = decode_parameter(parama, &parametera_extra_word_needed, &parametera_extra_word_value);
-			if(exit_app == 1)
+			parametera = decode_parameter(chunk, parama, &parametera_extra_word_needed, &parametera_extra_word_value);
+			if(chunk->exit_app == 1)
 				return;
 			if (parametera_extra_word_needed == 1)
-				current_address++;
+				chunk->current_address++;
 				
 			/* Parameter B */
 			int parameterb_extra_word_needed = 0;
 			unsigned short parameterb_extra_word_value = 0;
-			parameterb = decode_parameter(paramb, &parameterb_extra_word_needed, &parameterb_extra_word_value);
-			if(exit_app == 1)
+			parameterb = decode_parameter(chunk, paramb, &parameterb_extra_word_needed, &parameterb_extra_word_value);
+			if(chunk->exit_app == 1)
 				return;
 			if (parameterb_extra_word_needed == 1)
-				current_address++;
+				chunk->current_address++;
 				
 			/* Put everything together */
 			unsigned short first_word = ((parameterb & 0x3F) << 10) | ((parametera & 0x3F) << 4) | (basic_opcode & 0xF);
 			
 			/* Print to screen */
-			printf("%04X ", first_word);
-			if(parametera_extra_word_needed == 1)
-				printf("%04X ", parametera_extra_word_value);
-			if(parameterb_extra_word_needed == 1)
-				printf("%04X ", parameterb_extra_word_value);
-			printf("\n");
+			if (listing) {
+				printf("%04X ", first_word);
+				if(parametera_extra_word_needed == 1)
+					printf("%04X ", parametera_extra_word_value);
+				if(parameterb_extra_word_needed == 1)
+					printf("%04X ", parameterb_extra_word_value);
+				printf("\n");
+			}
 			
-			/* Write to file */
-			fwrite(&first_word, 1, 2, output);
+			/* Write to chunk */
+			unsigned short words[3];
+			int word_count = 0;
+			words[word_count++] = first_word;
 			if(parametera_extra_word_needed == 1)
-				fwrite(&parametera_extra_word_value, 1, 2, output);
+				words[word_count++] = parametera_extra_word_value;
 			if(parameterb_extra_word_needed == 1)
-				fwrite(&parameterb_extra_word_value, 1, 2, output);
+				words[word_count++] = parameterb_extra_word_value;
+			append_words(chunk, words, word_count, chunk->current_address - word_count);
 		} else {
-			printf("Missing comma on line %d\n", line_num);
-			exit_app = 1;
+			set_error(chunk, "Missing comma");
 			return;
 		}
 	}
 	
 	/* Non basic instructions */
 	if (non_basic_opcode == 0x1) { /* JSR */
-		char* param = line + 3; /* Cut off first 3 characters */
+		char* param = skip_space(line + 3); /* Cut off first 3 characters */
 		unsigned char parameter = 0;
 		
 		/* Increment address for the start word */
-		current_address++;
+		chunk->current_address++;
 		
 		/* Decode parameter */
 		int parameter_extra_word_needed = 0;
 		unsigned short parameter_extra_word_value = 0;
-		parameter = decode_parameter(param, &parameter_extra_word_needed, &parameter_extra_word_value);
-		if(exit_app == 1)
+		parameter = decode_parameter(chunk, param, &parameter_extra_word_needed, &parameter_extra_word_value);
+		if(chunk->exit_app == 1)
 			return;
 		if (parameter_extra_word_needed == 1)
-			current_address++;
+			chunk->current_address++;
 			
 		/* Put everything together */
 		unsigned short first_word = ((parameter & 0x3F) << 10) | ((non_basic_opcode & 0x3F) << 4) | (basic_opcode & 0xF);
 		
 		/* Print to screen */
-		printf("%04X ", first_word);
-		if(parameter_extra_word_needed == 1)
-			printf("%04X ", parameter_extra_word_value);
-		printf("\n");
+		if (listing) {
+			printf("%04X ", first_word);
+			if(parameter_extra_word_needed == 1)
+				printf("%04X ", parameter_extra_word_value);
+			printf("\n");
+		}
 		
-		/* Write to file */
-		fwrite(&first_word, 1, 2, output);
+		/* Write to chunk */
+		unsigned short words[2];
+		int word_count = 0;
+		words[word_count++] = first_word;
 		if(parameter_extra_word_needed == 1)
-			fwrite(&parameter_extra_word_value, 1, 2, output);
+			words[word_count++] = parameter_extra_word_value;
+		append_words(chunk, words, word_count, chunk->current_address - word_count);
 	}
 	
 }
 
+/*
+ * This works like fgets, reading the next line of the chunk into line. Returns -1 if the line doesn't fit
+ */
+int read_line(struct chunk* chunk, char* line, int size)
+{
+	int char_num = 0;
+	if (chunk->text == chunk->text_end)
+		return 0;
+	while (char_num < size - 1 && chunk->text != chunk->text_end) {
+		line[char_num] = *chunk->text;
+		char_num++;
+		chunk->text++;
+		if (line[char_num - 1] == '\n')
+			break;
+	}
+	line[char_num] = 0;
+	if (line[char_num - 1] != '\n' && chunk->text != chunk->text_end)
+		return -1;
+	return 1;
+}
+
+void* assemble_chunk(void* data)
+{
+	struct chunk* chunk = data;
+	char line[MAX_LINE_LENGTH];
+	int result = 0;
+	while ((result = read_line(chunk, line, MAX_LINE_LENGTH)) != 0) {
+		if (result == -1) {
+			set_error(chunk, "Line too long");
+			break;
+		}
+		process_line(chunk, line);
+		if (chunk->exit_app)
+			break;
+		chunk->line_num++;
+	}
+	return 0;
+}
+
+unsigned int hash_name(const char* name)
+{
+	unsigned int hash = 2166136261u;
+	while (*name != 0) {
+		hash = (hash ^ (unsigned char)*name) * 16777619u;
+		name++;
+	}
+	return hash;
+}
+
+/*
+ * Returns the slot in the label table for this name, either the label itself or an empty slot
+ */
+struct linked_label* find_label(const char* name)
+{
+	unsigned int slot = hash_name(name) & (label_table_size - 1);
+	while (label_table[slot].name != 0 && strcmp(label_table[slot].name, name) != 0)
+		slot = (slot + 1) & (label_table_size - 1);
+	return &label_table[slot];
+}
+
+/*
+ * This fills in the label references in a chunk. Addresses in labelrefs are still relative to the chunk
+ */
+void* link_chunk(void* data)
+{
+	struct chunk* chunk = data;
+	int labelref_num = 0;
+	for (labelref_num = 0; labelref_num < chunk->labelref_count; labelref_num++) {
+		const char* name = &chunk->names[chunk->labelrefs[labelref_num].name];
+		struct linked_label* label = find_label(name);
+		if (label->name == 0 && chunk->labelrefs[labelref_num].data) {
+			snprintf(chunk->error, sizeof(chunk->error), "Undefined label %s", name);
+			chunk->exit_app = 1;
+			return 0;
+		}
+		if (label->name != 0) {
+			if (label->address > 0xFFFF) {
+				snprintf(chunk->error, sizeof(chunk->error), "Label %s is outside the 64K word address space", label->name);
+				chunk->exit_app = 1;
+				return 0;
+			}
+			chunk->words[chunk->labelrefs[labelref_num].address] = label->address;
+			if (listing)
+				printf("LINKED: %s (%04X)\n", label->name, chunk->base_address + chunk->labelrefs[labelref_num].address);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Reads everything left in a file that can't be mapped into memory. Returns 0 on failure
+ */
+char* read_all(int file, size_t* size)
+{
+	char* text = 0;
+	int capacity = 0;
+	int length = 0;
+	ssize_t read_size = 0;
+	do {
+		text = grow_array(text, &capacity, length + 4096, 1);
+		read_size = read(file, text + length, capacity - length);
+		if (read_size > 0)
+			length += read_size;
+	} while (read_size > 0);
+	if (read_size == -1) {
+		free(text);
+		return 0;
+	}
+	*size = length;
+	return text;
+}
+
+/*
+ * This runs function on every chunk, each on its own thread. Chunks that can't get a thread run on this one
+ */
+void run_on_chunks(struct chunk* chunks, int chunk_count, void* (*function)(void*))
+{
+	int chunk_num = 0;
+	for (chunk_num = 1; chunk_num < chunk_count; chunk_num++)
+		chunks[chunk_num].threaded = pthread_create(&chunks[chunk_num].thread, 0, function, &chunks[chunk_num]) == 0;
+	function(&chunks[0]);
+	for (chunk_num = 1; chunk_num < chunk_count; chunk_num++) {
+		if (chunks[chunk_num].threaded)
+			pthread_join(chunks[chunk_num].thread, 0);
+		else
+			function(&chunks[chunk_num]);
+	}
+}
+
 int main(int argc, char* argv[])
 {
 	/* Process arguements */
-	if (argc > 3 || argc < 2) {
-		printf("useage: %s input [output]\n", argv[0]);
+	int thread_count = 1;
+	int arg_num = 1;
+	if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+		thread_count = atoi(argv[2]);
+		arg_num = 3;
+	}
+	if (argc - arg_num > 2 || argc - arg_num < 1 || thread_count < 1) {
+		printf("useage: %s [-j threads] input [output]\n", argv[0]);
 		return 0;
 	}
+	if (thread_count > MAX_THREADS)
+		thread_count = MAX_THREADS;
+	listing = thread_count == 1;
 	
 	/* Open input file */
-	FILE* input = fopen(argv[1], "r");
-	if (input == 0) {
+	int input = open(argv[arg_num], O_RDONLY);
+	struct stat input_stat;
+	if (input == -1 || fstat(input, &input_stat) == -1) {
 		printf("failed to open input file\n");
 		return 0;
 	}
+	size_t input_size = input_stat.st_size;
+	const char* text = "";
+	if (S_ISREG(input_stat.st_mode) && input_size > 0) {
+		text = mmap(0, input_size, PROT_READ, MAP_PRIVATE, input, 0);
+		if (text == MAP_FAILED) {
+			printf("failed to open input file\n");
+			return 0;
+		}
+	} else if (!S_ISREG(input_stat.st_mode)) {
+		/* Pipes and the like can't be mapped, read them into memory instead */
+		text = read_all(input, &input_size);
+		if (text == 0) {
+			printf("failed to read input file\n");
+			return 0;
+		}
+	}
 	
 	/* Open output file */
-	output = 0;
-	if (argc == 2)
+	FILE* output = 0;
+	if (argc - arg_num == 1)
 		output = fopen("out.bin", "wb");
 	else
-		output = fopen(argv[2], "wb");
+		output = fopen(argv[arg_num + 1], "wb");
 	if (output == 0) {
 		printf("failed to open output file\n");
 		return 0;
 	}
 	
-	/* Read lines */
-	char line[256];
-	line_num = 1;
-	exit_app = 0;
-	current_address = 0;
-	while (fgets(line, 256, input) != 0) {
-		process_line(line);
-		if(exit_app)
-			return 0;
-		line_num++;
+	/* Split input into chunks of whole lines */
+	struct chunk* chunks = calloc(thread_count, sizeof(struct chunk));
+	if (chunks == 0) {
+		printf("out of memory\n");
+		return 0;
+	}
+	const char* chunk_start = text;
+	int chunk_num = 0;
+	for (chunk_num = 0; chunk_num < thread_count; chunk_num++) {
+		const char* chunk_end = text + input_size;
+		if (chunk_num < thread_count - 1) {
+			chunk_end = text + input_size / thread_count * (chunk_num + 1);
+			if (chunk_end < chunk_start)
+				chunk_end = chunk_start;
+			if (chunk_end > text && chunk_end[-1] != '\n') {
+				chunk_end = memchr(chunk_end, '\n', text + input_size - chunk_end);
+				chunk_end = chunk_end == 0 ? text + input_size : chunk_end + 1;
+			}
+		}
+		chunks[chunk_num].text = chunk_start;
+		chunks[chunk_num].text_start = chunk_start;
+		chunks[chunk_num].text_end = chunk_end;
+		chunk_start = chunk_end;
 	}
 	
-	int label_num = 0;
-	for (label_num = 0; label_num < label_count; label_num++) {
-		printf("LABEL: %s (%04X)\n", labels[label_num].name, labels[label_num].address);
+	/* Assemble chunks */
+	run_on_chunks(chunks, thread_count, assemble_chunk);
+		
+	/* Work out where each chunk starts */
+	int line_num = 1;
+	unsigned int address = 0;
+	unsigned int label_count = 0;
+	for (chunk_num = 0; chunk_num < thread_count; chunk_num++) {
+		chunks[chunk_num].first_line = line_num;
+		chunks[chunk_num].base_address = address;
+		line_num += chunks[chunk_num].line_num;
+		address += chunks[chunk_num].current_address;
+		label_count += chunks[chunk_num].label_count;
 	}
 	
-	/* Link */
-	int labelref_num = 0;
-	for (labelref_num = 0; labelref_num < labelref_count; labelref_num++) {
+	/* Report the first error, the same one a single thread would stop at. A chunk can only tell it runs past
+	   64K once it knows where it starts, so a chunk that failed or overflowed is assembled again from there */
+	for (chunk_num = 0; chunk_num < thread_count; chunk_num++) {
+		struct chunk* chunk = &chunks[chunk_num];
+		if (!chunk->exit_app && chunk->base_address + chunk->current_address <= 0x10000)
+			continue;
+		if (chunk->base_address > 0) {
+			chunk->text = chunk->text_start;
+			chunk->exit_app = 0;
+			chunk->line_num = 0;
+			chunk->current_address = 0;
+			chunk->names_size = 0;
+			chunk->label_count = 0;
+			chunk->labelref_count = 0;
+			assemble_chunk(chunk);
+		}
+		printf("%s on line %d\n", chunk->error, chunk->first_line + chunk->line_num);
+		return 0;
+	}
+	
+	/* Put all labels into one table */
+	label_table_size = 16;
+	while (label_table_size < label_count * 2)
+		label_table_size *= 2;
+	label_table = calloc(label_table_size, sizeof(struct linked_label));
+	if (label_table == 0) {
+		printf("out of memory\n");
+		return 0;
+	}
+	for (chunk_num = 0; chunk_num < thread_count; chunk_num++) {
+		struct chunk* chunk = &chunks[chunk_num];
 		int label_num = 0;
-		for (label_num = 0; label_num < label_count; label_num++) {
-			if (strcmp(labels[label_num].name, labelrefs[labelref_num].name) == 0) {
-				/* Seek to position of label ref */
-				fseek(output, labelrefs[labelref_num].address * 2, SEEK_SET);
-				fwrite(&labels[label_num].address, 1, 2, output);
-				printf("LINKED: %s (%04X)\n", labels[label_num].name, labelrefs[labelref_num].address);
-			}
+		for (label_num = 0; label_num < chunk->label_count; label_num++) {
+			const char* name = &chunk->names[chunk->labels[label_num].name];
+			struct linked_label* label = find_label(name);
+			label->name = name;
+			label->address = chunk->base_address + chunk->labels[label_num].address;
+			if (listing)
+				printf("LABEL: %s (%04X)\n", name, label->address);
 		}
 	}
+	
+	/* Link */
+	run_on_chunks(chunks, thread_count, link_chunk);
+	for (chunk_num = 0; chunk_num < thread_count; chunk_num++) {
+		if (chunks[chunk_num].exit_app) {
+			printf("%s\n", chunks[chunk_num].error);
+			return 0;
+		}
+	}
+		
+	/* Write to file */
+	for (chunk_num = 0; chunk_num < thread_count; chunk_num++) {
+		if (chunks[chunk_num].current_address > 0)
+			fwrite(chunks[chunk_num].words, 2, chunks[chunk_num].current_address, output);
+	}
+	fclose(output);
+	return 0;
 }
@@ -26,7 +26,10 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <memory.h>
+#include <pthread.h>
 
 struct dcpu16
 {
@@ -36,68 +39,76 @@ struct dcpu16
 	unsigned short sp;
 	unsigned short o;
 	int skip_next_instruction;
-} cpu;
+	unsigned long long cycles;
+};
 
-unsigned short* decode_parameter(unsigned char paramvalue, unsigned short* literal)
+/* Print every instruction as it runs. Turned off in cluster mode */
+int trace = 1;
+
+/* Cycles for each basic opcode, plus one for each extra word. Failed IFs take one more, which pays for skipping
+   the next instruction */
+const int basic_cycles[16] = {0, 1, 2, 2, 2, 3, 3, 2, 2, 1, 1, 1, 2, 2, 2, 2};
+
+unsigned short* decode_parameter(struct dcpu16* cpu, unsigned char paramvalue, unsigned short* literal)
 {
 	/* Check if this is a register */
 	if (paramvalue < 0x08) {
-		unsigned short* registers = &cpu.a;
+		unsigned short* registers = &cpu->a;
 		return &registers[paramvalue];
 	}
 	
 	/* Check if this is a register pointer */
 	if (paramvalue < 0x10) {
-		unsigned short* registers = &cpu.a;
-		return &cpu.ram[registers[paramvalue]];
+		unsigned short* registers = &cpu->a;
+		return &cpu->ram[registers[paramvalue - 0x08]];
 	}
 	
 	/* Check if this is a register pointer with added word value */
 	if (paramvalue < 0x18) {
-		unsigned short* registers = &cpu.a;
-		unsigned short word = cpu.ram[cpu.pc++];
-		return &cpu.ram[registers[paramvalue] + word];
+		unsigned short* registers = &cpu->a;
+		unsigned short word = cpu->ram[cpu->pc++];
+		return &cpu->ram[registers[paramvalue - 0x10] + word];
 	}
 	
 	/* POP */
 	if (paramvalue == 0x18) {
-		return &cpu.ram[cpu.sp++];
+		return &cpu->ram[cpu->sp++];
 	}
 	
 	/* PEEK */
 	if (paramvalue == 0x19) {
-		return &cpu.ram[cpu.sp];
+		return &cpu->ram[cpu->sp];
 	}
 	
 	/* PUSH */
 	if (paramvalue == 0x1a) {
-		return &cpu.ram[--cpu.sp];
+		return &cpu->ram[--cpu->sp];
 	}
 	
 	/* SP */
 	if (paramvalue == 0x1b) {
-		return &cpu.sp;
+		return &cpu->sp;
 	}
 	
 	/* PC */
 	if (paramvalue == 0x1c) {
-		return &cpu.pc;
+		return &cpu->pc;
 	}
 	
 	/* O */
 	if (paramvalue == 0x1d) {
-		return &cpu.o;
+		return &cpu->o;
 	}
 	
 	/* Check if this is a word pointer */
 	if (paramvalue == 0x1e) {
-		unsigned short word = cpu.ram[cpu.pc++];
-		return &cpu.ram[word];
+		unsigned short word = cpu->ram[cpu->pc++];
+		return &cpu->ram[word];
 	}
 	
 	/* Check if this is a word literal */
 	if (paramvalue == 0x1f) {
-		return &cpu.ram[cpu.pc++];
+		return &cpu->ram[cpu->pc++];
 	}
 	
 	/* This must be a literal */
@@ -105,66 +116,82 @@ unsigned short* decode_parameter(unsigned char paramvalue, unsigned short* liter
 	return literal;
 }
 
-void run_instruction()
+/*
+ * This runs one instruction. Returns the RAM address it wrote to, or -1 if it didn't write to RAM
+ */
+int run_instruction(struct dcpu16* cpu)
 {
+	unsigned short* written = 0;
+	
 	/* Get first word */
-	unsigned short first_word = cpu.ram[cpu.pc++];
+	unsigned short first_word = cpu->ram[cpu->pc++];
+	unsigned short first_param_word = cpu->pc;
 	
 	/* Decode operation */
 	unsigned char opcode = first_word & 0xF;
 	unsigned char parama = (first_word >> 4) & 0x3F;
 	unsigned char paramb = (first_word >> 10) & 0x3F;
-	printf("OPCODE: %04X (%u)\n", first_word, opcode);
+	if (trace)
+		printf("OPCODE: %04X (%u)\n", first_word, opcode);
 	
 	if (opcode == 0x0) { /* Non basic instruction */
 		/* Decode parameter */
 		unsigned short param_literal = 0;
-		unsigned short* param_value = decode_parameter(paramb, &param_literal);
+		unsigned short* param_value = decode_parameter(cpu, paramb, &param_literal);
 		
 		/* Decode operation */
-		if (cpu.skip_next_instruction == 0) {
+		if (cpu->skip_next_instruction == 0) {
+			cpu->cycles += (unsigned short)(cpu->pc - first_param_word);
 			if (parama == 0x1) { /* JSR */
-				cpu.ram[--cpu.sp] = cpu.pc;
-				cpu.pc = *param_value;
+				cpu->ram[--cpu->sp] = cpu->pc;
+				written = &cpu->ram[cpu->sp];
+				cpu->pc = *param_value;
+				cpu->cycles += 2;
+			} else {
+				cpu->cycles += 1;
 			}
 		} else {
-			cpu.skip_next_instruction = 0;
+			cpu->skip_next_instruction = 0;
 		}
 	} else {
 		/* Decode parameters */
 		unsigned short parama_literal = 0; /* These are here just incase the parameter is a short literal */
 		unsigned short paramb_literal = 0; /* It will need a different place to store short literals */
-		unsigned short* parama_value = decode_parameter(parama, &parama_literal);
-		unsigned short* paramb_value = decode_parameter(paramb, &paramb_literal);
+		unsigned short* parama_value = decode_parameter(cpu, parama, &parama_literal);
+		unsigned short* paramb_value = decode_parameter(cpu, paramb, &paramb_literal);
 		
 		/* Decode operation */
-		if (cpu.skip_next_instruction == 0) {
+		if (cpu->skip_next_instruction == 0) {
+			cpu->cycles += basic_cycles[opcode] + (unsigned short)(cpu->pc - first_param_word);
+			if (opcode < 0xC)
+				written = parama_value;
+				
 			if (opcode == 0x1) { /* SET */
 				*parama_value = *paramb_value;
 			} else if (opcode == 0x2) { /* ADD */
 				unsigned int value = *parama_value + *paramb_value;
 				if (value > 0xFFFF) {
-					cpu.o = 0x0001;
+					cpu->o = 0x0001;
 				}
 				*parama_value = value & 0xFFFF;
 			} else if (opcode == 0x3) { /* SUB */
 				int value = *parama_value - *paramb_value;
 				if (value < 0) {
-					cpu.o = 0xFFFF;
+					cpu->o = 0xFFFF;
 					*parama_value = -value;
 				} else{
 					*parama_value = value;
 				}
 			} else if (opcode == 0x4) { /* MUL */
 				unsigned int value = *parama_value * *paramb_value;
-				cpu.o = (value >> 16) & 0xFFFF;
+				cpu->o = (value >> 16) & 0xFFFF;
 				*parama_value = value & 0xFFFF;
 			} else if (opcode == 0x5) { /* DIV */
 				if (*paramb_value == 0) {
-					cpu.o = 0;
+					cpu->o = 0;
 					*parama_value = 0;
 				} else {
-					cpu.o = ((*parama_value << 16) / *paramb_value) & 0xFFFF;
+					cpu->o = ((*parama_value << 16) / *paramb_value) & 0xFFFF;
 					*parama_value = *parama_value / *paramb_value;
 				}
 			} else if (opcode == 0x6) { /* MOD */
@@ -174,10 +201,10 @@ void run_instruction()
 					*parama_value = *parama_value % *paramb_value;
 				}
 			} else if (opcode == 0x7) { /* SHL */
-				cpu.o = (*parama_value << (*paramb_value - 16)) & 0xFFFF;
+				cpu->o = (*parama_value << (*paramb_value - 16)) & 0xFFFF;
 				*parama_value = *parama_value << *paramb_value;
 			} else if (opcode == 0x8) { /* SHR */
-				cpu.o = (*parama_value >> (*paramb_value - 16)) & 0xFFFF;
+				cpu->o = (*parama_value >> (*paramb_value - 16)) & 0xFFFF;
 				*parama_value = *parama_value >> *paramb_value;
 			} else if (opcode == 0x9) { /* AND */
 				*parama_value = *parama_value & *paramb_value;
@@ -187,28 +214,428 @@ void run_instruction()
 				*parama_value = *parama_value ^ *paramb_value;
 			} else if (opcode == 0xC) { /* IFE */
 				if (*parama_value != *paramb_value)
-					cpu.skip_next_instruction = 1;
+					cpu->skip_next_instruction = 1;
 			} else if (opcode == 0xD) { /* IFN */
 				if (*parama_value == *paramb_value)
-					cpu.skip_next_instruction = 1;
+					cpu->skip_next_instruction = 1;
 			} else if (opcode == 0xE) { /* IFG */
 				if (*parama_value <= *paramb_value)
-					cpu.skip_next_instruction = 1;
+					cpu->skip_next_instruction = 1;
 			} else if (opcode == 0xF) { /* IFB */
 				if ((*parama_value & *paramb_value) == 0)
-					cpu.skip_next_instruction = 1;
+					cpu->skip_next_instruction = 1;
+			}
+			
+			/* Failed tests take an extra cycle */
+			cpu->cycles += cpu->skip_next_instruction;
+		} else {
+			cpu->skip_next_instruction = 0;
+		}
+	}
+	
+	if (written >= cpu->ram && written < cpu->ram + 0x100000)
+		return written - cpu->ram;
+	return -1;
+}
+
+/*
+ * Returns 1 if the CPU is stuck on SET PC, <own address>
+ */
+int is_halted(struct dcpu16* cpu)
+{
+	unsigned short first_word = cpu->ram[cpu->pc];
+	unsigned char paramb = (first_word >> 10) & 0x3F;
+	
+	if (cpu->skip_next_instruction != 0 || (first_word & 0x3FF) != 0x1c1)
+		return 0;
+	if (paramb == 0x1f)
+		return cpu->ram[(unsigned short)(cpu->pc + 1)] == cpu->pc;
+	return paramb >= 0x20 && paramb - 0x20 == cpu->pc;
+}
+
+/*
+ * Cluster mode runs several CPUs on a pool of host threads. Each CPU sees the same memory map:
+ *
+ *   0xE000 - 0xEFFF  Shared window
+ *   0xF000           Core number (read only)
+ *   0xF001           Number of cores (read only)
+ *   0xF002           Core to send to
+ *   0xF003           Write a word here to send it
+ *   0xF004           Core to receive from
+ *   0xF005           Next word from that core (read only)
+ *   0xF006           Number of words waiting from that core (read only)
+ *   0xF007           Write anything here to move onto the next word
+ *   0xF008           Space left in the mailbox to the send core (read only)
+ *
+ * CPUs run in lock step, one quantum of cycles at a time. Writes to the shared window and words sent through
+ * mailboxes only become visible to other cores at the end of a quantum, so every run gives the same result
+ * whatever order the host threads run in. When two cores write the same shared word in one quantum, the higher
+ * numbered core wins.
+ */
+#define SHARED_BASE 0xE000
+#define SHARED_SIZE 0x1000
+#define MAILBOX_BASE 0xF000
+#define MAILBOX_ID 0xF000
+#define MAILBOX_COUNT 0xF001
+#define MAILBOX_SEND_TO 0xF002
+#define MAILBOX_SEND 0xF003
+#define MAILBOX_RECV_FROM 0xF004
+#define MAILBOX_RECV 0xF005
+#define MAILBOX_RECV_READY 0xF006
+#define MAILBOX_RECV_NEXT 0xF007
+#define MAILBOX_SEND_SPACE 0xF008
+#define MAILBOX_END 0xF010
+#define MAILBOX_SIZE 64
+
+/*
+ * A single producer, single consumer ring. head is only written by the receiving core's thread and tail by the
+ * sending core's thread. The visible_ copies are what the other side sees, and are updated between quanta.
+ */
+struct mailbox
+{
+	unsigned short words[MAILBOX_SIZE];
+	unsigned int head, tail;
+	unsigned int visible_head, visible_tail;
+};
+
+struct shared_write
+{
+	unsigned short address;
+	unsigned short value;
+};
+
+struct core
+{
+	struct dcpu16 cpu;
+	int id;
+	int halted;
+	
+	/* Shared window writes made this quantum */
+	struct shared_write* writes;
+	int write_count;
+	int write_capacity;
+	
+	/* Statistics */
+	unsigned long long instructions;
+	unsigned long long sent, received, send_full;
+	unsigned long long shared_writes, shared_conflicts;
+};
+
+struct cluster
+{
+	struct core* cores;
+	int core_count;
+	int thread_count;
+	unsigned long long quantum;
+	unsigned long long max_cycles;
+	
+	struct mailbox* mailboxes; /* mailboxes[from * core_count + to] */
+	unsigned short shared[SHARED_SIZE];
+	int shared_writer[SHARED_SIZE];
+	unsigned long long shared_stamp[SHARED_SIZE];
+	int shared_dirty;
+	
+	/* Held while worker threads are started, so they all see the final thread count */
+	pthread_mutex_t start_lock;
+	int abort;
+	pthread_barrier_t barrier;
+} cluster;
+
+struct mailbox* get_mailbox(int from, int to)
+{
+	return &cluster.mailboxes[from * cluster.core_count + to];
+}
+
+/*
+ * This fills in the read only mailbox registers
+ */
+void refresh_mailbox_registers(struct core* core)
+{
+	unsigned short* ram = core->cpu.ram;
+	unsigned short from = ram[MAILBOX_RECV_FROM];
+	unsigned short to = ram[MAILBOX_SEND_TO];
+	
+	ram[MAILBOX_ID] = core->id;
+	ram[MAILBOX_COUNT] = cluster.core_count;
+	ram[MAILBOX_SEND] = 0;
+	ram[MAILBOX_RECV] = 0;
+	ram[MAILBOX_RECV_READY] = 0;
+	ram[MAILBOX_RECV_NEXT] = 0;
+	ram[MAILBOX_SEND_SPACE] = 0;
+	
+	if (from < cluster.core_count) {
+		struct mailbox* mailbox = get_mailbox(from, core->id);
+		unsigned int ready = mailbox->visible_tail - mailbox->head;
+		ram[MAILBOX_RECV_READY] = ready;
+		if (ready > 0)
+			ram[MAILBOX_RECV] = mailbox->words[mailbox->head % MAILBOX_SIZE];
+	}
+	if (to < cluster.core_count) {
+		struct mailbox* mailbox = get_mailbox(core->id, to);
+		ram[MAILBOX_SEND_SPACE] = MAILBOX_SIZE - (mailbox->tail - mailbox->visible_head);
+	}
+}
+
+/*
+ * This handles a write to the shared window or the mailbox registers
+ */
+void handle_write(struct core* core, int address)
+{
+	unsigned short* ram = core->cpu.ram;
+	
+	if (address >= SHARED_BASE && address < SHARED_BASE + SHARED_SIZE) {
+		if (core->write_count == core->write_capacity) {
+			core->write_capacity = core->write_capacity == 0 ? 256 : core->write_capacity * 2;
+			core->writes = realloc(core->writes, core->write_capacity * sizeof(struct shared_write));
+			if (core->writes == 0) {
+				printf("out of memory\n");
+				exit(1);
 			}
+		}
+		core->writes[core->write_count].address = address - SHARED_BASE;
+		core->writes[core->write_count].value = ram[address];
+		core->write_count++;
+		core->shared_writes++;
+		return;
+	}
+	
+	if (address < MAILBOX_BASE || address >= MAILBOX_END)
+		return;
+		
+	if (address == MAILBOX_SEND && ram[MAILBOX_SEND_TO] < cluster.core_count) {
+		struct mailbox* mailbox = get_mailbox(core->id, ram[MAILBOX_SEND_TO]);
+		if (mailbox->tail - mailbox->visible_head < MAILBOX_SIZE) {
+			mailbox->words[mailbox->tail % MAILBOX_SIZE] = ram[MAILBOX_SEND];
+			mailbox->tail++;
+			core->sent++;
 		} else {
-			cpu.skip_next_instruction = 0;
+			core->send_full++;
+		}
+	}
+	
+	if (address == MAILBOX_RECV_NEXT && ram[MAILBOX_RECV_FROM] < cluster.core_count) {
+		struct mailbox* mailbox = get_mailbox(ram[MAILBOX_RECV_FROM], core->id);
+		if (mailbox->visible_tail != mailbox->head) {
+			mailbox->head++;
+			core->received++;
+		}
+	}
+	
+	refresh_mailbox_registers(core);
+}
+
+void run_quantum(struct core* core, unsigned long long quantum_end)
+{
+	while (core->cpu.cycles < quantum_end) {
+		if (is_halted(&core->cpu)) {
+			core->halted = 1;
+			return;
+		}
+		int address = run_instruction(&core->cpu);
+		core->instructions++;
+		if (address >= SHARED_BASE && address < MAILBOX_END)
+			handle_write(core, address);
+	}
+}
+
+/*
+ * This applies every core's shared window writes from the last quantum, in core order
+ */
+void merge_shared_writes(unsigned long long quantum_num)
+{
+	int core_num = 0;
+	cluster.shared_dirty = 0;
+	for (core_num = 0; core_num < cluster.core_count; core_num++) {
+		struct core* core = &cluster.cores[core_num];
+		int write_num = 0;
+		for (write_num = 0; write_num < core->write_count; write_num++) {
+			unsigned short address = core->writes[write_num].address;
+			if (cluster.shared_stamp[address] == quantum_num + 1 && cluster.shared_writer[address] != core_num)
+				core->shared_conflicts++;
+			cluster.shared_stamp[address] = quantum_num + 1;
+			cluster.shared_writer[address] = core_num;
+			cluster.shared[address] = core->writes[write_num].value;
+			cluster.shared_dirty = 1;
+		}
+	}
+}
+
+void* run_cluster_thread(void* data)
+{
+	int thread_num = (int)(long)data;
+	unsigned long long quantum_num = 0;
+	int core_num = 0;
+	
+	/* Wait until every thread that is going to start has started */
+	pthread_mutex_lock(&cluster.start_lock);
+	pthread_mutex_unlock(&cluster.start_lock);
+	if (cluster.abort)
+		return 0;
+		
+	for (quantum_num = 0; ; quantum_num++) {
+		unsigned long long quantum_end = (quantum_num + 1) * cluster.quantum;
+		if (cluster.max_cycles != 0 && quantum_end > cluster.max_cycles)
+			quantum_end = cluster.max_cycles;
+			
+		/* Run this thread's cores */
+		for (core_num = thread_num; core_num < cluster.core_count; core_num += cluster.thread_count) {
+			if (!cluster.cores[core_num].halted)
+				run_quantum(&cluster.cores[core_num], quantum_end);
+		}
+		pthread_barrier_wait(&cluster.barrier);
+		
+		/* Nothing runs between these barriers, so everyone sees the same state */
+		if (thread_num == 0)
+			merge_shared_writes(quantum_num);
+		for (core_num = thread_num; core_num < cluster.core_count; core_num += cluster.thread_count) {
+			int other_num = 0;
+			for (other_num = 0; other_num < cluster.core_count; other_num++) {
+				struct mailbox* outgoing = get_mailbox(core_num, other_num);
+				struct mailbox* incoming = get_mailbox(other_num, core_num);
+				outgoing->visible_tail = outgoing->tail;
+				incoming->visible_head = incoming->head;
+			}
+		}
+		int finished = cluster.max_cycles != 0 && quantum_end >= cluster.max_cycles;
+		int halted_count = 0;
+		for (core_num = 0; core_num < cluster.core_count; core_num++)
+			halted_count += cluster.cores[core_num].halted;
+		if (halted_count == cluster.core_count)
+			finished = 1;
+		pthread_barrier_wait(&cluster.barrier);
+		
+		/* Bring this thread's cores up to date */
+		for (core_num = thread_num; core_num < cluster.core_count; core_num += cluster.thread_count) {
+			struct core* core = &cluster.cores[core_num];
+			if (cluster.shared_dirty)
+				memcpy(&core->cpu.ram[SHARED_BASE], cluster.shared, sizeof(cluster.shared));
+			core->write_count = 0;
+			refresh_mailbox_registers(core);
+		}
+		
+		if (finished)
+			return 0;
+	}
+}
+
+int run_cluster(int core_count, int thread_count, unsigned long long quantum, unsigned long long max_cycles, int input_count, char* inputs[])
+{
+	int core_num = 0;
+	
+	cluster.core_count = core_count;
+	cluster.thread_count = thread_count;
+	cluster.quantum = quantum;
+	cluster.max_cycles = max_cycles;
+	cluster.cores = calloc(core_count, sizeof(struct core));
+	cluster.mailboxes = calloc(core_count * core_count, sizeof(struct mailbox));
+	if (cluster.cores == 0 || cluster.mailboxes == 0) {
+		printf("out of memory\n");
+		return 0;
+	}
+	
+	/* Load cores, either one image each or the same image on all of them */
+	for (core_num = 0; core_num < core_count; core_num++) {
+		struct core* core = &cluster.cores[core_num];
+		FILE* input = fopen(inputs[core_num % input_count], "rb");
+		if (input == 0) {
+			printf("failed to open input file %s\n", inputs[core_num % input_count]);
+			return 0;
 		}
+		core->id = core_num;
+		core->cpu.sp = 0xFFFF;
+		fread(core->cpu.ram, 2, 0x100000, input);
+		fclose(input);
+		
+		/* The shared window starts off empty */
+		memset(&core->cpu.ram[SHARED_BASE], 0, SHARED_SIZE * 2);
+		refresh_mailbox_registers(core);
+	}
+	
+	/* Run */
+	pthread_t* threads = calloc(thread_count, sizeof(pthread_t));
+	int thread_num = 0;
+	if (threads == 0 || pthread_mutex_init(&cluster.start_lock, 0) != 0) {
+		printf("failed to start threads\n");
+		return 0;
+	}
+	pthread_mutex_lock(&cluster.start_lock);
+	for (thread_num = 1; thread_num < thread_count; thread_num++) {
+		if (pthread_create(&threads[thread_num], 0, run_cluster_thread, (void*)(long)thread_num) != 0)
+			break;
+	}
+	
+	/* Carry on with the threads that did start, results don't depend on the thread count */
+	if (thread_num < thread_count) {
+		printf("only started %d of %d threads\n", thread_num, thread_count);
+		thread_count = thread_num;
+		cluster.thread_count = thread_count;
+	}
+	if (pthread_barrier_init(&cluster.barrier, 0, thread_count) != 0) {
+		printf("failed to start threads\n");
+		cluster.abort = 1;
 	}
+	pthread_mutex_unlock(&cluster.start_lock);
+	
+	if (!cluster.abort)
+		run_cluster_thread(0);
+	for (thread_num = 1; thread_num < thread_count; thread_num++)
+		pthread_join(threads[thread_num], 0);
+	pthread_mutex_destroy(&cluster.start_lock);
+	if (cluster.abort)
+		return 0;
+	pthread_barrier_destroy(&cluster.barrier);
+	
+	/* Print statistics */
+	for (core_num = 0; core_num < core_count; core_num++) {
+		struct core* core = &cluster.cores[core_num];
+		struct dcpu16* cpu = &core->cpu;
+		printf("CORE %d%s: %llu cycles, %llu instructions, %llu sent, %llu received, %llu send full, %llu shared writes, %llu shared conflicts\n",
+			core_num, core->halted ? " (halted)" : "", cpu->cycles, core->instructions, core->sent, core->received,
+			core->send_full, core->shared_writes, core->shared_conflicts);
+		printf("A: %04X, B: %04X, C: %04X, X: %04X, Y: %04X, Z: %04X, I: %04X, J: %04X, PC: %04X, SP: %04X, O: %04X\n", cpu->a, cpu->b, cpu->c, cpu->x, cpu->y, cpu->z, cpu->i, cpu->j, cpu->pc, cpu->sp, cpu->o);
+	}
+	return 0;
 }
 
 int main(int argc, char* argv[])
 {
 	/* Process arguements */
+	int core_count = 0;
+	int thread_count = 1;
+	unsigned long long quantum = 1000;
+	unsigned long long max_cycles = 0;
+	int arg_num = 1;
+	while (arg_num + 1 < argc && argv[arg_num][0] == '-') {
+		if (strcmp(argv[arg_num], "-c") == 0) {
+			core_count = atoi(argv[arg_num + 1]);
+		} else if (strcmp(argv[arg_num], "-t") == 0) {
+			thread_count = atoi(argv[arg_num + 1]);
+		} else if (strcmp(argv[arg_num], "-q") == 0) {
+			quantum = strtoull(argv[arg_num + 1], 0, 10);
+		} else if (strcmp(argv[arg_num], "-n") == 0) {
+			max_cycles = strtoull(argv[arg_num + 1], 0, 10);
+		} else {
+			break;
+		}
+		arg_num += 2;
+	}
+	int input_count = argc - arg_num;
+	
+	/* Cluster mode */
+	if (core_count > 0) {
+		if (input_count < 1 || (input_count != 1 && input_count != core_count) || thread_count < 1 || quantum == 0) {
+			printf("useage: %s -c cores [-t threads] [-q quantum] [-n cycles] input [input...]\n", argv[0]);
+			return 0;
+		}
+		if (thread_count > core_count)
+			thread_count = core_count;
+		trace = 0;
+		return run_cluster(core_count, thread_count, quantum, max_cycles, input_count, &argv[arg_num]);
+	}
+	
 	if (argc > 2 || argc < 2) {
 		printf("useage: %s input\n", argv[0]);
+		printf("        %s -c cores [-t threads] [-q quantum] [-n cycles] input [input...]\n", argv[0]);
 		return 0;
 	}
 	
@@ -220,16 +647,20 @@ int main(int argc, char* argv[])
 	}
 	
 	/* Initialise CPU */
-	memset(&cpu, 0, sizeof(struct dcpu16));
-	cpu.sp = 0xFFFF;
+	struct dcpu16* cpu = calloc(1, sizeof(struct dcpu16));
+	if (cpu == 0) {
+		printf("out of memory\n");
+		return 0;
+	}
+	cpu->sp = 0xFFFF;
 	
 	/* Read words into RAM */
-	fread(cpu.ram, 2, 0x100000, input);
+	fread(cpu->ram, 2, 0x100000, input);
 	
 	/* Run */
 	for (;;) {
-		printf("\nA: %04X, B: %04X, C: %04X, X: %04X, Y: %04X, Z: %04X, I: %04X, J: %04X, PC: %04X, SP: %04X, O: %04X\n", cpu.a, cpu.b, cpu.c, cpu.x, cpu.y, cpu.z, cpu.i, cpu.j, cpu.pc, cpu.sp, cpu.o);
-		run_instruction();
+		printf("\nA: %04X, B: %04X, C: %04X, X: %04X, Y: %04X, Z: %04X, I: %04X, J: %04X, PC: %04X, SP: %04X, O: %04X\n", cpu->a, cpu->b, cpu->c, cpu->x, cpu->y, cpu->z, cpu->i, cpu->j, cpu->pc, cpu->sp, cpu->o);
+		run_instruction(cpu);
 	}
 
 }
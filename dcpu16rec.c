@@ -0,0 +1,610 @@
+/* dcpu16rec.c - Static recompiler for the DCPU-16 CPU
+   version 1, 19 October 2026
+
+   Copyright (C) 2012 Karl Hobley
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation
+   files (the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy,
+   modify, merge, publish, distribute, sublicense, and/or sell copies
+   of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+   OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+   Karl Hobley <turbodog10@yahoo.co.uk>
+*/
+
+/*
+ * This reads a binary image, follows its control flow from address 0 and
+ * writes C source with one function per basic block. Build the output with
+ * "cc -O2 out.c" for an executable, or with "-DDCPU16_LIBRARY -shared -fPIC"
+ * for a shared object exporting dcpu16_reset() and dcpu16_run().
+ *
+ * Anything that can't be recompiled (indirect jumps into the middle of a
+ * block, code outside the image, code that has been overwritten) is run by
+ * an interpreter embedded in the output.
+ *
+ * The emulator never stops, so the recompiled program needs its own rule for
+ * when it is finished: it stops when it reaches SET PC, <its own address>,
+ * which is how DCPU-16 programs usually hang.
+ *
+ * Build the output with -DDCPU16_SELFTEST to run the program once with the
+ * recompiled blocks and once with only the interpreter, and compare the final
+ * state. rectest.sh does this for a list of images.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+unsigned short image[0x100000];
+int image_size;
+
+unsigned char leader[0x10000];
+unsigned char visited[0x10000];
+unsigned char code_map[0x10000];
+
+unsigned short worklist[0x10000];
+int worklist_count;
+
+const char* register_names[] = {"a", "b", "c", "x", "y", "z", "i", "j"};
+
+/*
+ * This is the part of the output that doesn't depend on the image. The
+ * interpreter mirrors run_instruction() in dcpu16emu.c.
+ */
+const char* runtime_source[] = {
+	"#include <stdio.h>",
+	"#include <string.h>",
+	"",
+	"struct dcpu16",
+	"{",
+	"	unsigned short ram[0x100000];",
+	"	unsigned short a, b, c, x, y, z, i, j;",
+	"	unsigned short pc;",
+	"	unsigned short sp;",
+	"	unsigned short o;",
+	"	int skip_next_instruction;",
+	"} cpu;",
+	"",
+	"/* Set once a word of recompiled code is overwritten, recompiled blocks aren't used after that */",
+	"static int smc;",
+	"static unsigned char code_map[0x10000];",
+	"",
+	"#define MARK_WRITE(p) do { if ((p) >= cpu.ram && (p) < cpu.ram + 0x10000 && code_map[(p) - cpu.ram]) smc = 1; } while (0)",
+	"",
+	"#define LOAD_REGISTERS() \\",
+	"	unsigned short a = cpu.a, b = cpu.b, c = cpu.c, x = cpu.x, y = cpu.y, z = cpu.z, i = cpu.i, j = cpu.j; \\",
+	"	unsigned short sp = cpu.sp, o = cpu.o, pc = 0, lit_a = 0, lit_b = 0; \\",
+	"	unsigned short *pa = 0, *pb = 0; \\",
+	"	int skip = 0; \\",
+	"	(void)pc; (void)lit_a; (void)lit_b; (void)pa; (void)pb; (void)skip",
+	"",
+	"#define STORE_REGISTERS() \\",
+	"	cpu.a = a; cpu.b = b; cpu.c = c; cpu.x = x; cpu.y = y; cpu.z = z; cpu.i = i; cpu.j = j; \\",
+	"	cpu.sp = sp; cpu.o = o",
+	"",
+	"#define LEAVE(next) do { STORE_REGISTERS(); cpu.pc = (next); cpu.skip_next_instruction = skip; return 1; } while (0)",
+	"#define HALT(here) do { STORE_REGISTERS(); cpu.pc = (here); cpu.skip_next_instruction = 0; return 0; } while (0)",
+	"",
+	"static unsigned short* decode_parameter(unsigned char paramvalue, unsigned short* literal)",
+	"{",
+	"	unsigned short* registers = &cpu.a;",
+	"	if (paramvalue < 0x08)",
+	"		return &registers[paramvalue];",
+	"	if (paramvalue < 0x10)",
+	"		return &cpu.ram[registers[paramvalue - 0x08]];",
+	"	if (paramvalue < 0x18) {",
+	"		unsigned short word = cpu.ram[cpu.pc++];",
+	"		return &cpu.ram[registers[paramvalue - 0x10] + word];",
+	"	}",
+	"	if (paramvalue == 0x18)",
+	"		return &cpu.ram[cpu.sp++];",
+	"	if (paramvalue == 0x19)",
+	"		return &cpu.ram[cpu.sp];",
+	"	if (paramvalue == 0x1a)",
+	"		return &cpu.ram[--cpu.sp];",
+	"	if (paramvalue == 0x1b)",
+	"		return &cpu.sp;",
+	"	if (paramvalue == 0x1c)",
+	"		return &cpu.pc;",
+	"	if (paramvalue == 0x1d)",
+	"		return &cpu.o;",
+	"	if (paramvalue == 0x1e) {",
+	"		unsigned short word = cpu.ram[cpu.pc++];",
+	"		return &cpu.ram[word];",
+	"	}",
+	"	if (paramvalue == 0x1f)",
+	"		return &cpu.ram[cpu.pc++];",
+	"	*literal = paramvalue - 0x20;",
+	"	return literal;",
+	"}",
+	"",
+	"/* Returns 0 if the CPU has halted */",
+	"static int interpret_instruction(void)",
+	"{",
+	"	unsigned short first_word = cpu.ram[cpu.pc];",
+	"	unsigned char opcode = first_word & 0xF;",
+	"	unsigned char parama = (first_word >> 4) & 0x3F;",
+	"	unsigned char paramb = (first_word >> 10) & 0x3F;",
+	"	unsigned short* written = 0;",
+	"",
+	"	/* SET PC, <own address> */",
+	"	if (cpu.skip_next_instruction == 0 && opcode == 0x1 && parama == 0x1c) {",
+	"		if (paramb == 0x1f && cpu.ram[(unsigned short)(cpu.pc + 1)] == cpu.pc)",
+	"			return 0;",
+	"		if (paramb >= 0x20 && paramb - 0x20 == cpu.pc)",
+	"			return 0;",
+	"	}",
+	"	cpu.pc++;",
+	"",
+	"	if (opcode == 0x0) {",
+	"		unsigned short param_literal = 0;",
+	"		unsigned short* param_value = decode_parameter(paramb, &param_literal);",
+	"		if (cpu.skip_next_instruction == 0) {",
+	"			if (parama == 0x1) {",
+	"				cpu.ram[--cpu.sp] = cpu.pc;",
+	"				written = &cpu.ram[cpu.sp];",
+	"				cpu.pc = *param_value;",
+	"			}",
+	"		} else {",
+	"			cpu.skip_next_instruction = 0;",
+	"		}",
+	"	} else {",
+	"		unsigned short parama_literal = 0;",
+	"		unsigned short paramb_literal = 0;",
+	"		unsigned short* pa = decode_parameter(parama, &parama_literal);",
+	"		unsigned short* pb = decode_parameter(paramb, &paramb_literal);",
+	"		unsigned short o = cpu.o;",
+	"		int skip = 0;",
+	"		if (cpu.skip_next_instruction == 0) {",
+	"			/* The operations use a local O so they can be shared with recompiled blocks */",
+	"			if (pa == &cpu.o)",
+	"				pa = &o;",
+	"			if (pb == &cpu.o)",
+	"				pb = &o;",
+	"			switch (opcode) {",
+	"			case 0x1: DCPU16_SET; break;",
+	"			case 0x2: DCPU16_ADD; break;",
+	"			case 0x3: DCPU16_SUB; break;",
+	"			case 0x4: DCPU16_MUL; break;",
+	"			case 0x5: DCPU16_DIV; break;",
+	"			case 0x6: DCPU16_MOD; break;",
+	"			case 0x7: DCPU16_SHL; break;",
+	"			case 0x8: DCPU16_SHR; break;",
+	"			case 0x9: DCPU16_AND; break;",
+	"			case 0xA: DCPU16_BOR; break;",
+	"			case 0xB: DCPU16_XOR; break;",
+	"			case 0xC: DCPU16_IFE; break;",
+	"			case 0xD: DCPU16_IFN; break;",
+	"			case 0xE: DCPU16_IFG; break;",
+	"			case 0xF: DCPU16_IFB; break;",
+	"			}",
+	"			cpu.o = o;",
+	"			cpu.skip_next_instruction = skip;",
+	"			if (opcode < 0xC)",
+	"				written = pa;",
+	"		} else {",
+	"			cpu.skip_next_instruction = 0;",
+	"		}",
+	"	}",
+	"",
+	"	if (written != 0)",
+	"		MARK_WRITE(written);",
+	"	return 1;",
+	"}",
+	0
+};
+
+/*
+ * These are the basic operations, written in terms of pa, pb, o and skip.
+ * They are copied from run_instruction() in dcpu16emu.c.
+ */
+const char* operation_source[] = {
+	0,
+	"*pa = *pb",
+	"{ unsigned int value = *pa + *pb; if (value > 0xFFFF) o = 0x0001; *pa = value & 0xFFFF; }",
+	"{ int value = *pa - *pb; if (value < 0) { o = 0xFFFF; *pa = -value; } else { *pa = value; } }",
+	"{ unsigned int value = *pa * *pb; o = (value >> 16) & 0xFFFF; *pa = value & 0xFFFF; }",
+	"if (*pb == 0) { o = 0; *pa = 0; } else { o = ((*pa << 16) / *pb) & 0xFFFF; *pa = *pa / *pb; }",
+	"if (*pb == 0) { *pa = 0; } else { *pa = *pa % *pb; }",
+	"{ o = (*pa << (*pb - 16)) & 0xFFFF; *pa = *pa << *pb; }",
+	"{ o = (*pa >> (*pb - 16)) & 0xFFFF; *pa = *pa >> *pb; }",
+	"*pa = *pa & *pb",
+	"*pa = *pa | *pb",
+	"*pa = *pa ^ *pb",
+	"skip = *pa != *pb",
+	"skip = *pa == *pb",
+	"skip = *pa <= *pb",
+	"skip = (*pa & *pb) == 0"
+};
+
+const char* operation_names[] = {
+	0, "SET", "ADD", "SUB", "MUL", "DIV", "MOD", "SHL", "SHR",
+	"AND", "BOR", "XOR", "IFE", "IFN", "IFG", "IFB"
+};
+
+/*
+ * Returns 1 if this parameter takes an extra word
+ */
+int parameter_has_word(unsigned char param)
+{
+	return (param >= 0x10 && param < 0x18) || param == 0x1e || param == 0x1f;
+}
+
+/*
+ * Returns 1 if this parameter points into RAM
+ */
+int parameter_is_memory(unsigned char param)
+{
+	return (param >= 0x08 && param < 0x1b) || param == 0x1e || param == 0x1f;
+}
+
+unsigned short get_instruction_length(unsigned short address)
+{
+	unsigned short first_word = image[address];
+	unsigned char opcode = first_word & 0xF;
+	unsigned char parama = (first_word >> 4) & 0x3F;
+	unsigned char paramb = (first_word >> 10) & 0x3F;
+
+	if (opcode == 0x0)
+		return 1 + parameter_has_word(paramb);
+	return 1 + parameter_has_word(parama) + parameter_has_word(paramb);
+}
+
+/*
+ * Works out where a SET PC, <literal> jumps to. Returns -1 if the target isn't known until run time
+ */
+int get_jump_target(unsigned short address)
+{
+	unsigned short first_word = image[address];
+	unsigned char opcode = first_word & 0xF;
+	unsigned char parama = (first_word >> 4) & 0x3F;
+	unsigned char paramb = (first_word >> 10) & 0x3F;
+
+	if (opcode == 0x0) {
+		if (parama != 0x1)
+			return -1;
+		if (paramb == 0x1f)
+			return image[(unsigned short)(address + 1)];
+	} else {
+		if (opcode != 0x1 || parama != 0x1c)
+			return -1;
+		if (paramb == 0x1f)
+			return image[(unsigned short)(address + 1)];
+	}
+	if (paramb >= 0x20)
+		return paramb - 0x20;
+	return -1;
+}
+
+/*
+ * Returns 1 if the instruction sets PC. JSR counts as setting PC
+ */
+int instruction_sets_pc(unsigned short address)
+{
+	unsigned short first_word = image[address];
+	unsigned char opcode = first_word & 0xF;
+	unsigned char parama = (first_word >> 4) & 0x3F;
+
+	if (opcode == 0x0)
+		return parama == 0x1;
+	return opcode < 0xC && parama == 0x1c;
+}
+
+void add_leader(unsigned short address)
+{
+	if (leader[address])
+		return;
+	leader[address] = 1;
+	worklist[worklist_count] = address;
+	worklist_count++;
+}
+
+/*
+ * This follows every path from the entry point and marks the start of each basic block
+ */
+void find_blocks()
+{
+	add_leader(0);
+	while (worklist_count > 0) {
+		worklist_count--;
+		unsigned short address = worklist[worklist_count];
+		int previous_was_if = 0;
+
+		while (address < image_size) {
+			/* Another path runs into the middle of an existing block, split it here */
+			if (visited[address]) {
+				leader[address] = 1;
+				break;
+			}
+
+			unsigned short length = get_instruction_length(address);
+			unsigned short next_address = address + length;
+			int word_num = 0;
+
+			visited[address] = 1;
+			for (word_num = 0; word_num < length; word_num++)
+				code_map[(unsigned short)(address + word_num)] = 1;
+
+			if (instruction_sets_pc(address)) {
+				int target = get_jump_target(address);
+				if (target != -1)
+					add_leader(target);
+
+				/* JSR returns through SET PC, POP */
+				if ((image[address] & 0xF) == 0x0)
+					add_leader(next_address);
+
+				if (!previous_was_if)
+					break;
+			}
+
+			previous_was_if = (image[address] & 0xF) >= 0xC;
+			address = next_address;
+		}
+	}
+}
+
+/*
+ * This writes a statement that points pointer at the value of a parameter. Extra words are read from word_address
+ */
+void write_parameter(FILE* out, const char* pointer, const char* literal, unsigned char param, unsigned short* word_address)
+{
+	if (param < 0x08) {
+		fprintf(out, "\t\t%s = &%s;\n", pointer, register_names[param]);
+	} else if (param < 0x10) {
+		fprintf(out, "\t\t%s = &cpu.ram[%s];\n", pointer, register_names[param - 0x08]);
+	} else if (param < 0x18) {
+		fprintf(out, "\t\t%s = &cpu.ram[%s + 0x%04X];\n", pointer, register_names[param - 0x10], image[*word_address]);
+		(*word_address)++;
+	} else if (param == 0x18) {
+		fprintf(out, "\t\t%s = &cpu.ram[sp++];\n", pointer);
+	} else if (param == 0x19) {
+		fprintf(out, "\t\t%s = &cpu.ram[sp];\n", pointer);
+	} else if (param == 0x1a) {
+		fprintf(out, "\t\t%s = &cpu.ram[--sp];\n", pointer);
+	} else if (param == 0x1b) {
+		fprintf(out, "\t\t%s = &sp;\n", pointer);
+	} else if (param == 0x1c) {
+		fprintf(out, "\t\t%s = &pc;\n", pointer);
+	} else if (param == 0x1d) {
+		fprintf(out, "\t\t%s = &o;\n", pointer);
+	} else if (param == 0x1e) {
+		fprintf(out, "\t\t%s = &cpu.ram[0x%04X];\n", pointer, image[*word_address]);
+		(*word_address)++;
+	} else if (param == 0x1f) {
+		fprintf(out, "\t\t%s = &cpu.ram[0x%04X];\n", pointer, *word_address);
+		(*word_address)++;
+	} else {
+		fprintf(out, "\t\t%s = 0x%04X;\n", literal, param - 0x20);
+		fprintf(out, "\t\t%s = &%s;\n", pointer, literal);
+	}
+}
+
+void write_block(FILE* out, unsigned short address)
+{
+	int previous_was_if = 0;
+
+	fprintf(out, "static int block_%04X(void)\n{\n", address);
+	fprintf(out, "\tLOAD_REGISTERS();\n");
+
+	for (;;) {
+		unsigned short first_word = image[address];
+		unsigned char opcode = first_word & 0xF;
+		unsigned char parama = (first_word >> 4) & 0x3F;
+		unsigned char paramb = (first_word >> 10) & 0x3F;
+		unsigned short length = get_instruction_length(address);
+		unsigned short next_address = address + length;
+		unsigned short word_address = address + 1;
+		int sets_pc = instruction_sets_pc(address);
+		const char* indent = previous_was_if ? "\t\t\t" : "\t\t";
+
+		/* Comment with the original instruction */
+		fprintf(out, "\n\t/* %04X: %s */\n\t{\n", address, opcode == 0x0 ? (parama == 0x1 ? "JSR" : "NOP") : operation_names[opcode]);
+
+		/* PC reads as the address after the whole instruction */
+		if (sets_pc || parama == 0x1c || paramb == 0x1c)
+			fprintf(out, "\t\tpc = 0x%04X;\n", next_address);
+
+		/* Decode parameters. This has side effects on SP even if the instruction is skipped */
+		if (opcode != 0x0)
+			write_parameter(out, "pa", "lit_a", parama, &word_address);
+		write_parameter(out, "pb", "lit_b", paramb, &word_address);
+
+		if (previous_was_if)
+			fprintf(out, "\t\tif (!skip) {\n");
+
+		if (opcode == 0x0) {
+			if (parama == 0x1) {
+				fprintf(out, "%scpu.ram[--sp] = pc;\n", indent);
+				fprintf(out, "%sMARK_WRITE(&cpu.ram[sp]);\n", indent);
+				fprintf(out, "%sLEAVE(*pb);\n", indent);
+			}
+		} else if (opcode == 0x1 && parama == 0x1c && get_jump_target(address) == address) {
+			fprintf(out, "%sHALT(0x%04X);\n", indent, address);
+		} else {
+			fprintf(out, "%sDCPU16_%s;\n", indent, operation_names[opcode]);
+			if (sets_pc) {
+				fprintf(out, "%sLEAVE(pc);\n", indent);
+			} else if (opcode < 0xC && parameter_is_memory(parama)) {
+				fprintf(out, "%sMARK_WRITE(pa);\n", indent);
+				fprintf(out, "%sif (smc)\n%s\tLEAVE(0x%04X);\n", indent, indent, next_address);
+			}
+		}
+
+		if (previous_was_if)
+			fprintf(out, "\t\t} else {\n\t\t\tskip = 0;\n\t\t}\n");
+		fprintf(out, "\t}\n");
+
+		/* Unconditional jumps end the block */
+		if (sets_pc && !previous_was_if)
+			break;
+
+		previous_was_if = opcode >= 0xC;
+		address = next_address;
+		if (leader[address] || !visited[address]) {
+			fprintf(out, "\tLEAVE(0x%04X);\n", address);
+			break;
+		}
+	}
+
+	fprintf(out, "}\n\n");
+}
+
+void write_image(FILE* out)
+{
+	int word_num = 0;
+	fprintf(out, "static const unsigned short image[%d] = {", image_size > 0 ? image_size : 1);
+	for (word_num = 0; word_num < image_size; word_num++) {
+		if (word_num % 8 == 0)
+			fprintf(out, "\n\t");
+		fprintf(out, "0x%04X, ", image[word_num]);
+	}
+	if (image_size == 0)
+		fprintf(out, "0");
+	fprintf(out, "\n};\n\n");
+
+	/* Code words, as ranges */
+	fprintf(out, "static const unsigned short code_ranges[][2] = {\n");
+	int address = 0;
+	while (address < 0x10000) {
+		if (code_map[address]) {
+			int end = address;
+			while (end < 0x10000 && code_map[end])
+				end++;
+			fprintf(out, "\t{0x%04X, 0x%04X},\n", address, end - address);
+			address = end;
+		} else {
+			address++;
+		}
+	}
+	fprintf(out, "\t{0, 0}\n};\n\n");
+}
+
+void write_dispatcher(FILE* out)
+{
+	int address = 0;
+
+	fprintf(out, "/* Returns 1 to carry on, 0 if the CPU has halted or -1 if there is no block at PC */\n");
+	fprintf(out, "static int run_block(void)\n{\n\tswitch (cpu.pc) {\n");
+	for (address = 0; address < 0x10000; address++) {
+		if (leader[address] && visited[address])
+			fprintf(out, "\tcase 0x%04X: return block_%04X();\n", address, address);
+	}
+	fprintf(out, "\t}\n\treturn -1;\n}\n\n");
+
+	fprintf(out, "void dcpu16_reset(void)\n{\n");
+	fprintf(out, "\tint range_num = 0;\n");
+	fprintf(out, "\tmemset(&cpu, 0, sizeof(struct dcpu16));\n");
+	fprintf(out, "\tmemset(code_map, 0, sizeof(code_map));\n");
+	fprintf(out, "\tmemcpy(cpu.ram, image, sizeof(image));\n");
+	fprintf(out, "\tcpu.sp = 0xFFFF;\n");
+	fprintf(out, "\tsmc = 0;\n");
+	fprintf(out, "\tfor (range_num = 0; code_ranges[range_num][1] != 0; range_num++)\n");
+	fprintf(out, "\t\tmemset(&code_map[code_ranges[range_num][0]], 1, code_ranges[range_num][1]);\n");
+	fprintf(out, "}\n\n");
+
+	fprintf(out, "void dcpu16_run(void)\n{\n");
+	fprintf(out, "\tfor (;;) {\n");
+	fprintf(out, "\t\tif (!smc && !cpu.skip_next_instruction) {\n");
+	fprintf(out, "\t\t\tint result = run_block();\n");
+	fprintf(out, "\t\t\tif (result == 0)\n\t\t\t\treturn;\n");
+	fprintf(out, "\t\t\tif (result == 1)\n\t\t\t\tcontinue;\n");
+	fprintf(out, "\t\t}\n");
+	fprintf(out, "\t\tif (!interpret_instruction())\n\t\t\treturn;\n");
+	fprintf(out, "\t}\n}\n\n");
+
+	fprintf(out, "#ifndef DCPU16_LIBRARY\n");
+	fprintf(out, "int main(void)\n{\n");
+	fprintf(out, "\tdcpu16_reset();\n");
+	fprintf(out, "\tdcpu16_run();\n");
+	fprintf(out, "#ifdef DCPU16_SELFTEST\n");
+	fprintf(out, "\t/* Run again with only the interpreter and compare everything, including RAM */\n");
+	fprintf(out, "\tstatic struct dcpu16 recompiled;\n");
+	fprintf(out, "\tmemcpy(&recompiled, &cpu, sizeof(struct dcpu16));\n");
+	fprintf(out, "\tdcpu16_reset();\n");
+	fprintf(out, "\tsmc = 1;\n");
+	fprintf(out, "\tdcpu16_run();\n");
+	fprintf(out, "\tif (memcmp(&recompiled, &cpu, sizeof(struct dcpu16)) != 0) {\n");
+	fprintf(out, "\t\tprintf(\"SELFTEST: recompiled and interpreted state differ\\n\");\n");
+	fprintf(out, "\t\treturn 1;\n");
+	fprintf(out, "\t}\n");
+	fprintf(out, "\tprintf(\"SELFTEST: passed\\n\");\n");
+	fprintf(out, "#endif\n");
+	fprintf(out, "\tprintf(\"A: %%04X, B: %%04X, C: %%04X, X: %%04X, Y: %%04X, Z: %%04X, I: %%04X, J: %%04X, PC: %%04X, SP: %%04X, O: %%04X\\n\", ");
+	fprintf(out, "cpu.a, cpu.b, cpu.c, cpu.x, cpu.y, cpu.z, cpu.i, cpu.j, cpu.pc, cpu.sp, cpu.o);\n");
+	fprintf(out, "\treturn 0;\n}\n#endif\n");
+}
+
+int main(int argc, char* argv[])
+{
+	/* Process arguements */
+	if (argc > 3 || argc < 2) {
+		printf("useage: %s input [output]\n", argv[0]);
+		return 0;
+	}
+
+	/* Open input file */
+	FILE* input = fopen(argv[1], "rb");
+	if (input == 0) {
+		printf("failed to open input file\n");
+		return 0;
+	}
+
+	/* Open output file */
+	FILE* output = 0;
+	if (argc == 2)
+		output = fopen("out.c", "w");
+	else
+		output = fopen(argv[2], "w");
+	if (output == 0) {
+		printf("failed to open output file\n");
+		return 0;
+	}
+
+	/* Read image */
+	image_size = fread(image, 2, 0x100000, input);
+	fclose(input);
+
+	/* Recover control flow */
+	find_blocks();
+
+	/* Write runtime, with the operations as macros so the interpreter and blocks share them */
+	int line_num = 0;
+	fprintf(output, "/* Generated by dcpu16rec from %s */\n\n", argv[1]);
+	int opcode = 0;
+	for (opcode = 1; opcode < 16; opcode++)
+		fprintf(output, "#define DCPU16_%s %s\n", operation_names[opcode], operation_source[opcode]);
+	fprintf(output, "\n");
+	for (line_num = 0; runtime_source[line_num] != 0; line_num++)
+		fprintf(output, "%s\n", runtime_source[line_num]);
+	fprintf(output, "\n");
+	write_image(output);
+
+	/* Write blocks */
+	int block_count = 0;
+	int address = 0;
+	for (address = 0; address < 0x10000; address++) {
+		if (leader[address] && visited[address]) {
+			write_block(output, address);
+			block_count++;
+		}
+	}
+
+	write_dispatcher(output);
+	fclose(output);
+
+	printf("RECOMPILED: %d words, %d blocks\n", image_size, block_count);
+	return 0;
+}
@@ -0,0 +1,74 @@
+#!/bin/sh
+# rectest.sh - Checks the recompiler against its embedded interpreter and the emulator
+#
+# useage: rectest.sh [program...]
+#
+# Programs are assembly sources (.txt) or assembled images, test.txt and
+# rectest.txt are used when none are given. Each one is recompiled and built
+# with DCPU16_SELFTEST, which runs it once with the recompiled blocks and once
+# with only the interpreter, then compares the final CPU state and RAM. The
+# final registers are then compared with dcpu16emu running the same image.
+# Programs must halt with SET PC, <own address>.
+
+CC=${CC:-cc}
+DIR=$(dirname "$0")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# Seconds any one program may run for, and the emulator's cycle limit
+TIME_LIMIT=10
+CYCLE_LIMIT=100000000
+
+$CC -O2 -pthread -o "$WORK/dcpu16asm" "$DIR/dcpu16asm.c" || exit 1
+$CC -O2 -pthread -o "$WORK/dcpu16emu" "$DIR/dcpu16emu.c" || exit 1
+$CC -O2 -o "$WORK/dcpu16rec" "$DIR/dcpu16rec.c" || exit 1
+
+if [ $# -eq 0 ]; then
+	set -- "$DIR/test.txt" "$DIR/rectest.txt"
+fi
+
+failed=0
+for program in "$@"; do
+	image=$program
+	rm -f "$WORK/result.txt" "$WORK/emulator.txt"
+	case "$program" in
+	*.txt)
+		# The assembler prints nothing with more than one thread unless it fails
+		image="$WORK/image.bin"
+		if ! "$WORK/dcpu16asm" -j 2 "$program" "$image" > "$WORK/result.txt" \
+			|| [ -s "$WORK/result.txt" ]; then
+			echo "FAILED: $program (assembler)"
+			cat "$WORK/result.txt"
+			failed=1
+			continue
+		fi
+		;;
+	esac
+
+	if ! "$WORK/dcpu16rec" "$image" "$WORK/out.c" > /dev/null \
+		|| ! $CC -O2 -DDCPU16_SELFTEST -o "$WORK/out" "$WORK/out.c" \
+		|| ! timeout $TIME_LIMIT "$WORK/out" > "$WORK/result.txt"; then
+		echo "FAILED: $program (recompiler)"
+		cat "$WORK/result.txt" 2> /dev/null
+		failed=1
+		continue
+	fi
+
+	if ! timeout $TIME_LIMIT "$WORK/dcpu16emu" -c 1 -n $CYCLE_LIMIT "$image" > "$WORK/emulator.txt" \
+		|| ! grep -q '^CORE 0 (halted)' "$WORK/emulator.txt"; then
+		echo "FAILED: $program (emulator didn't halt)"
+		cat "$WORK/emulator.txt"
+		failed=1
+		continue
+	fi
+
+	if [ "$(grep '^A:' "$WORK/result.txt")" != "$(grep '^A:' "$WORK/emulator.txt")" ]; then
+		echo "FAILED: $program (registers differ from the emulator)"
+		echo "recompiled: $(grep '^A:' "$WORK/result.txt")"
+		echo "emulator:   $(grep '^A:' "$WORK/emulator.txt")"
+		failed=1
+		continue
+	fi
+	echo "PASSED: $program"
+done
+exit $failed